@@ -0,0 +1,102 @@
+#!/bin/sh
+# Compare the cost of rendering a flood of output with a translucent,
+# an automatically opaque and an opaque background.
+#
+# usage: bench/opacity.sh [ST] [LINES] [RUNS]
+#
+# For every mode the same output is cat'ed in a new window, which closes
+# once it is done. The window is started with ST_FRAME_STATS set, so it
+# reports the mean and worst interval between presented frames taken
+# from the GDK frame clock. Reported next to them are the wall clock
+# time to get through the output and the CPU time the compositor used
+# meanwhile. Set COMPOSITOR to the process name of your compositor if it
+# isn't found automatically. Start it on an idle desktop and don't touch
+# the windows while it runs.
+
+set -e
+
+st=${1:-./st}
+lines=${2:-200000}
+runs=${3:-5}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+if [ -z "$COMPOSITOR" ]; then
+	for name in gnome-shell kwin_wayland kwin_x11 mutter picom compton xfwm4 sway weston; do
+		if pgrep -x "$name" >/dev/null; then
+			COMPOSITOR=$name
+			break
+		fi
+	done
+fi
+cpid=
+[ -n "$COMPOSITOR" ] && cpid=$(pgrep -o -x "$COMPOSITOR" || true)
+if [ -z "$cpid" ]; then
+	echo "no compositor found, only reporting wall clock time" >&2
+fi
+
+hz=$(getconf CLK_TCK)
+
+# user and system time of a process in clock ticks
+ticks() {
+	if [ -n "$1" ] && [ -r "/proc/$1/stat" ]; then
+		# skip past the command name, which may contain spaces
+		sed 's/^.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }'
+	else
+		echo 0
+	fi
+}
+
+now() {
+	date +%s.%N
+}
+
+seq "$lines" | sed 's/$/ the quick brown fox jumps over the lazy dog/' > "$tmp/output"
+
+config() {
+	cat > "$tmp/$1.ini" <<EOC
+[options]
+lines = 10000
+auto-opaque = $3
+opaque-rate = 1
+
+[colors]
+foreground = #e6e6e6
+background = $2
+EOC
+}
+
+config translucent 'rgba(0,0,0,0.9)' false
+config auto-opaque 'rgba(0,0,0,0.9)' true
+config opaque 'rgba(0,0,0,1)' false
+
+printf '%-12s %9s %10s %10s %14s\n' mode seconds frame-ms max-ms compositor-cpu
+for mode in translucent auto-opaque opaque; do
+	i=0
+	while [ "$i" -lt "$runs" ]; do
+		c0=$(ticks "$cpid")
+		t0=$(now)
+		ST_FRAME_STATS=1 "$st" -c "$tmp/$mode.ini" -- cat "$tmp/output" \
+			2>"$tmp/stats"
+		t1=$(now)
+		c1=$(ticks "$cpid")
+		# frames N interval MEAN max MAX refresh REFRESH
+		stats=$(awk '$1 == "frames" { print $2, $4, $6 }' "$tmp/stats")
+		echo "$t0 $t1 $c0 $c1 ${stats:-0 0 0}"
+		i=$((i + 1))
+	done | awk -v mode="$mode" -v hz="$hz" '
+		{
+			wall += $2 - $1
+			cpu += ($4 - $3) / hz
+			frames += $5
+			interval += $5 * $6
+			if ($7 > max)
+				max = $7
+			n++
+		}
+		END {
+			printf "%-12s %9.3f %10.3f %10.3f %14.3f\n", mode, wall / n,
+				frames ? interval / frames : 0, max, cpu / n
+		}'
+done
@@ -18,7 +18,18 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <gio/gunixsocketaddress.h>
 #include <vte/vte.h>
 
 #ifdef VTE_TYPE_REGEX
@@ -26,6 +37,10 @@
 #include <pcre2.h>
 #endif
 
+#define LAUNCHER_NAME "st-launcher"
+
+extern char **environ;
+
 static int exit_status = EXIT_FAILURE;
 
 static void
@@ -43,6 +58,210 @@ screen_changed(GtkWidget *widget, GdkScreen *old_screen, gpointer userdata)
 	gtk_widget_set_visual(widget, visual);
 }
 
+/*
+ * Translucency
+ *
+ * Blending a translucent window is expensive for the compositor, so with
+ * auto-opaque the background is painted opaque and the compositor told
+ * so while the window is maximized or fullscreen, or from when the
+ * terminal is updated at least opaque-rate times a second until it has
+ * been idle for a whole second. An opaque-rate of 0 disables the latter.
+ */
+static struct {
+	GtkWidget *window;
+	VteTerminal *terminal;
+	GdkRGBA background;
+	guint rate;
+	guint changes;
+	guint timeout;
+	gboolean maximized;
+	gboolean busy;
+	gboolean opaque;
+} opacity;
+
+static void
+opacity_region(GtkWidget *window)
+{
+	GtkWidget *widget = GTK_WIDGET(opacity.terminal);
+	GdkWindow *gdkwin = gtk_widget_get_window(window);
+	cairo_region_t *region = NULL;
+
+	if (!gdkwin)
+		return;
+
+	/* only the terminal is opaque, not any client side
+	 * decorations and their shadows around it */
+	if (opacity.opaque) {
+		cairo_rectangle_int_t rect;
+		GtkAllocation allocation;
+
+		gtk_widget_get_allocation(widget, &allocation);
+		if (!gtk_widget_translate_coordinates(widget, window,
+					0, 0, &rect.x, &rect.y))
+			return;
+		rect.width = allocation.width;
+		rect.height = allocation.height;
+		region = cairo_region_create_rectangle(&rect);
+	}
+	gdk_window_set_opaque_region(gdkwin, region);
+	if (region)
+		cairo_region_destroy(region);
+}
+
+static void
+opacity_update(void)
+{
+	gboolean opaque = opacity.maximized || opacity.busy;
+	GdkRGBA background = opacity.background;
+
+	if (opaque == opacity.opaque)
+		return;
+
+	opacity.opaque = opaque;
+	if (opaque)
+		background.alpha = 1.;
+	vte_terminal_set_color_background(opacity.terminal, &background);
+	opacity_region(opacity.window);
+}
+
+static gboolean
+opacity_window_state(GtkWidget *window, GdkEvent *event, gpointer data)
+{
+	opacity.maximized = (event->window_state.new_window_state &
+			(GDK_WINDOW_STATE_MAXIMIZED | GDK_WINDOW_STATE_FULLSCREEN)) != 0;
+	opacity_update();
+	return FALSE;
+}
+
+/* GTK resets the opaque region on every allocation and style update */
+static void
+opacity_size_allocate(GtkWidget *window, GdkRectangle *allocation, gpointer data)
+{
+	if (opacity.opaque)
+		opacity_region(window);
+}
+
+static void
+opacity_style_updated(GtkWidget *window, gpointer data)
+{
+	if (opacity.opaque)
+		opacity_region(window);
+}
+
+static gboolean
+opacity_tick(gpointer data)
+{
+	/* stay opaque until a whole second passes without updates */
+	if (opacity.changes >= opacity.rate)
+		opacity.busy = TRUE;
+	else if (opacity.changes == 0)
+		opacity.busy = FALSE;
+	opacity_update();
+
+	if (opacity.busy || opacity.changes) {
+		opacity.changes = 0;
+		return G_SOURCE_CONTINUE;
+	}
+
+	/* idle, start counting again on the next update */
+	opacity.timeout = 0;
+	return G_SOURCE_REMOVE;
+}
+
+static void
+opacity_contents_changed(VteTerminal *terminal, gpointer data)
+{
+	opacity.changes++;
+	if (!opacity.timeout)
+		opacity.timeout = g_timeout_add_seconds(1, opacity_tick, NULL);
+}
+
+static void
+opacity_setup(GtkWidget *window, VteTerminal *terminal,
+		const GdkRGBA *background, gint rate)
+{
+	opacity.window = window;
+	opacity.terminal = terminal;
+	opacity.background = *background;
+
+	g_signal_connect(window, "window-state-event",
+			G_CALLBACK(opacity_window_state), NULL);
+	g_signal_connect(window, "size-allocate",
+			G_CALLBACK(opacity_size_allocate), NULL);
+	g_signal_connect(window, "style-updated",
+			G_CALLBACK(opacity_style_updated), NULL);
+	if (rate > 0) {
+		opacity.rate = rate;
+		g_signal_connect(terminal, "contents-changed",
+				G_CALLBACK(opacity_contents_changed), NULL);
+	}
+}
+
+/*
+ * Frame statistics
+ *
+ * With ST_FRAME_STATS set in the environment the interval between
+ * presented frames is measured and printed when the window closes.
+ * Gaps of a second or more are idle time and not counted. This is
+ * what bench/opacity.sh uses to compare backgrounds.
+ */
+static struct {
+	gint64 counter;
+	gint64 last;
+	gint64 total;
+	gint64 max;
+	gint64 refresh;
+	guint frames;
+} frame_stats;
+
+static void
+frame_stats_after_paint(GdkFrameClock *clock, gpointer data)
+{
+	gint64 counter = gdk_frame_clock_get_frame_counter(clock);
+	gint64 i = MAX(frame_stats.counter, gdk_frame_clock_get_history_start(clock));
+
+	/* timings are only complete once the frame is presented */
+	for (; i < counter; i++) {
+		GdkFrameTimings *timings = gdk_frame_clock_get_timings(clock, i);
+		gint64 time;
+
+		if (timings == NULL || !gdk_frame_timings_get_complete(timings))
+			break;
+
+		time = gdk_frame_timings_get_presentation_time(timings);
+		if (time == 0)
+			time = gdk_frame_timings_get_frame_time(timings);
+		if (frame_stats.last && time - frame_stats.last < G_USEC_PER_SEC) {
+			gint64 interval = time - frame_stats.last;
+
+			frame_stats.total += interval;
+			frame_stats.max = MAX(frame_stats.max, interval);
+			frame_stats.frames++;
+		}
+		frame_stats.last = time;
+		frame_stats.refresh = gdk_frame_timings_get_refresh_interval(timings);
+	}
+	frame_stats.counter = i;
+}
+
+static void
+frame_stats_realize(GtkWidget *window, gpointer data)
+{
+	g_signal_connect(gtk_widget_get_frame_clock(window), "after-paint",
+			G_CALLBACK(frame_stats_after_paint), NULL);
+}
+
+static void
+frame_stats_print(GtkWidget *window, gpointer data)
+{
+	g_printerr("frames %u interval %.3f max %.3f refresh %.3f\n",
+			frame_stats.frames,
+			frame_stats.frames ?
+				frame_stats.total / 1000. / frame_stats.frames : 0.,
+			frame_stats.max / 1000.,
+			frame_stats.refresh / 1000.);
+}
+
 static void
 window_title_changed(GtkWidget *widget, gpointer window)
 {
@@ -84,6 +303,197 @@ child_exited(GtkWidget *terminal, int status, gpointer window)
 	destroy_and_quit(GTK_WIDGET(window));
 }
 
+/*
+ * Launcher
+ *
+ * Forking the terminal to open a url copies its large address space
+ * every time, so url programs are started by a helper process instead.
+ * The helper is our own binary, so it maps the same libraries, but it
+ * never initializes GTK and its heap stays tiny. It is spawned on first
+ * use, is handed urls over a socket and starts the program with
+ * posix_spawn.
+ */
+static struct {
+	GPid pid;
+	int fd;
+} launcher = { .fd = -1 };
+
+static int
+launcher_spawn(const gchar *path, gchar *program, gchar *match,
+		const posix_spawn_file_actions_t *actions,
+		const posix_spawnattr_t *attr)
+{
+	gchar *argv[3] = { program, match, NULL };
+	pid_t pid;
+
+	if (path == NULL)
+		return ENOENT;
+	return posix_spawn(&pid, path, actions, attr, argv, environ);
+}
+
+static void
+launcher_close_fds(int keep)
+{
+	GArray *fds = g_array_new(FALSE, FALSE, sizeof(int));
+	GDir *dir = g_dir_open("/proc/self/fd", 0, NULL);
+	const gchar *name;
+	guint i;
+
+	if (dir == NULL) {
+		g_array_free(fds, TRUE);
+		return;
+	}
+
+	/* don't close the directory's own fd while reading it */
+	while ((name = g_dir_read_name(dir))) {
+		int fd = atoi(name);
+
+		if (fd > STDERR_FILENO && fd != keep)
+			g_array_append_val(fds, fd);
+	}
+	g_dir_close(dir);
+
+	for (i = 0; i < fds->len; i++)
+		close(g_array_index(fds, int, i));
+	g_array_free(fds, TRUE);
+}
+
+static int
+launcher_main(int argc, char *argv[])
+{
+	static char match[65536];
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t signals;
+	gchar *program;
+	gchar *path;
+	int fd;
+
+	if (argc != 3)
+		return EXIT_FAILURE;
+
+	fd = atoi(argv[1]);
+	program = argv[2];
+
+	/* unlike g_spawn_async posix_spawn doesn't close other fds,
+	 * so close everything we inherited but the socket */
+	launcher_close_fds(fd);
+
+	/* don't leak the socket to the programs we start */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	path = g_find_program_in_path(program);
+
+	/* let children reap themselves, but don't pass that on */
+	signal(SIGCHLD, SIG_IGN);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attr, &signals);
+	sigaddset(&signals, SIGCHLD);
+	posix_spawnattr_setsigdefault(&attr, &signals);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+			"/dev/null", O_WRONLY, 0);
+
+	for (;;) {
+		ssize_t len = recv(fd, match, sizeof(match) - 1, MSG_TRUNC);
+		int ret;
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (len == 0) /* terminal exited */
+			break;
+		if ((size_t)len >= sizeof(match)) {
+			g_printerr("Error starting '%s': url too long\n", program);
+			continue;
+		}
+		match[len] = '\0';
+
+		ret = launcher_spawn(path, program, match, &actions, &attr);
+		if (ret == ENOENT) {
+			/* the program may have been moved, look it up again */
+			g_free(path);
+			path = g_find_program_in_path(program);
+			ret = launcher_spawn(path, program, match, &actions, &attr);
+		}
+		if (ret)
+			g_printerr("Error starting '%s': %s\n",
+					program, g_strerror(ret));
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	g_free(path);
+	return EXIT_SUCCESS;
+}
+
+static void
+launcher_exited(GPid pid, gint status, gpointer data)
+{
+	g_spawn_close_pid(pid);
+	close(launcher.fd);
+	launcher.fd = -1;
+	launcher.pid = 0;
+}
+
+static gboolean
+launcher_start(gchar *program)
+{
+	gchar fd[16];
+	gchar *argv[4] = { LAUNCHER_NAME, fd, program, NULL };
+	int sv[2];
+	pid_t pid;
+	int ret;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		g_printerr("Error starting launcher: %s\n", g_strerror(errno));
+		return FALSE;
+	}
+
+	/* only the helper's end is inherited */
+	fcntl(sv[1], F_SETFD, 0);
+	g_snprintf(fd, sizeof(fd), "%d", sv[1]);
+	ret = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, environ);
+	close(sv[1]);
+	if (ret) {
+		g_printerr("Error starting launcher: %s\n", g_strerror(ret));
+		close(sv[0]);
+		return FALSE;
+	}
+
+	launcher.pid = pid;
+	launcher.fd = sv[0];
+	g_child_watch_add(pid, launcher_exited, NULL);
+	return TRUE;
+}
+
+static void
+launch(gchar *program, gchar *match)
+{
+	GError *error = NULL;
+	gchar *argv[3] = { program, match, NULL };
+
+	if (match[0] == '\0')
+		return;
+
+	if ((launcher.fd >= 0 || launcher_start(program)) &&
+	    send(launcher.fd, match, strlen(match),
+		    MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+		return;
+
+	/* fall back to starting it ourselves */
+	if (!g_spawn_async(NULL, argv, NULL,
+				G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL,
+				NULL, NULL, NULL, &error)) {
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+	}
+}
+
 static int
 button_pressed(GtkWidget *widget, GdkEvent *event, gpointer program)
 {
@@ -95,15 +505,7 @@ button_pressed(GtkWidget *widget, GdkEvent *event, gpointer program)
 
 	match = vte_terminal_match_check_event(VTE_TERMINAL(widget), event, &tag);
 	if (match != NULL) {
-		GError *error = NULL;
-		gchar *argv[3] = { program, match, NULL };
-
-		if (!g_spawn_async(NULL, argv, NULL,
-					G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL,
-					NULL, NULL, NULL, &error)) {
-			g_printerr("%s\n", error->message);
-			g_error_free(error);
-		}
+		launch(program, match);
 		g_free(match);
 	}
 	return FALSE;
@@ -253,6 +655,228 @@ decrease_font_size(GtkWidget *widget, gpointer window)
 	adjust_font_size(widget, GTK_WINDOW(window), 1. / 1.125);
 }
 
+static void
+terminal_rows(VteTerminal *terminal, glong *first, glong *top, glong *bottom)
+{
+	GtkAdjustment *adj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(terminal));
+
+	if (first)
+		*first = gtk_adjustment_get_lower(adj);
+	if (top)
+		*top = gtk_adjustment_get_value(adj);
+	if (bottom)
+		*bottom = gtk_adjustment_get_upper(adj) - 1;
+}
+
+/* may return NULL */
+static gchar *
+terminal_text(VteTerminal *terminal, glong first, glong column, glong last)
+{
+#if VTE_CHECK_VERSION(0, 72, 0)
+	return vte_terminal_get_text_range_format(terminal, VTE_FORMAT_TEXT,
+			first, column,
+			last, vte_terminal_get_column_count(terminal),
+			NULL);
+#else
+	return vte_terminal_get_text_range(terminal,
+			first, column,
+			last, vte_terminal_get_column_count(terminal) - 1,
+			NULL, NULL, NULL);
+#endif
+}
+
+/*
+ * Prompt marks
+ *
+ * VTE 0.78 and newer report OSC 133 prompts as shell termprops. Older
+ * versions don't pass OSC 133 on to us, but their shell integration
+ * reports the working directory with OSC 7 before every prompt. Either
+ * way VTE only tells us after a whole chunk of output is processed, so
+ * the row recorded is where the cursor ended up, which is the last line
+ * of a multi-line prompt. Command output is taken to start on the line
+ * after Return is pressed, falling back to the line after the prompt.
+ * Rows only grow, so the array stays sorted and marks for rows evicted
+ * from the scrollback are dropped from the front.
+ */
+struct mark {
+	glong prompt;
+	glong output;
+};
+
+static GArray *marks;
+
+/* index of the first mark with prompt >= row */
+static guint
+marks_search(glong row)
+{
+	guint lo = 0;
+	guint hi = marks->len;
+
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+
+		if (g_array_index(marks, struct mark, mid).prompt < row)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void
+marks_expire(VteTerminal *terminal)
+{
+	glong first;
+	guint i;
+
+	terminal_rows(terminal, &first, NULL, NULL);
+	i = marks_search(first);
+	if (i)
+		g_array_remove_range(marks, 0, i);
+}
+
+static void
+prompt_mark(VteTerminal *terminal)
+{
+	struct mark mark = { .output = -1 };
+	glong column;
+
+	vte_terminal_get_cursor_position(terminal, &column, &mark.prompt);
+
+	/* drop marks at or below the new prompt in case
+	 * the terminal was reset or the prompt redrawn */
+	g_array_set_size(marks, marks_search(mark.prompt));
+	marks_expire(terminal);
+	g_array_append_val(marks, mark);
+}
+
+/* mark the output of the last command as starting offset rows below the cursor */
+static void
+prompt_command(VteTerminal *terminal, glong offset)
+{
+	struct mark *mark;
+	glong column;
+	glong row;
+
+	if (marks->len == 0)
+		return;
+
+	mark = &g_array_index(marks, struct mark, marks->len - 1);
+	if (mark->output >= 0)
+		return;
+
+	vte_terminal_get_cursor_position(terminal, &column, &row);
+	mark->output = row + offset;
+}
+
+#if VTE_CHECK_VERSION(0, 78, 0)
+/*
+ * Termprops changed by the same chunk of output are all reported at
+ * once, ordered by property rather than by when they arrived, so only
+ * look at them once the whole batch is in. A preexec together with a
+ * precmd can't be placed, as the command and its output both came and
+ * went, so only trust preexec when it arrives on its own.
+ */
+static struct {
+	guint idle;
+	gboolean precmd;
+	gboolean preexec;
+} shell;
+
+static gboolean
+prompt_shell_changed(gpointer data)
+{
+	VteTerminal *terminal = data;
+
+	if (shell.precmd)
+		prompt_mark(terminal);
+	else if (shell.preexec)
+		prompt_command(terminal, 0);
+
+	shell.idle = 0;
+	shell.precmd = FALSE;
+	shell.preexec = FALSE;
+	return G_SOURCE_REMOVE;
+}
+
+static void
+prompt_termprop(VteTerminal *terminal, const char *name, gpointer data)
+{
+	if (!strcmp(name, VTE_TERMPROP_SHELL_PRECMD))
+		shell.precmd = TRUE;
+	else
+		shell.preexec = TRUE;
+
+	if (!shell.idle)
+		shell.idle = g_idle_add_full(G_PRIORITY_HIGH,
+				prompt_shell_changed, terminal, NULL);
+}
+#else
+static void
+prompt_directory_changed(VteTerminal *terminal, gpointer data)
+{
+	prompt_mark(terminal);
+}
+#endif
+
+static void
+prompt_jump(VteTerminal *terminal, gboolean next)
+{
+	GtkAdjustment *adj = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(terminal));
+	glong top = gtk_adjustment_get_value(adj);
+	guint i;
+
+	marks_expire(terminal);
+	if (next) {
+		i = marks_search(top + 1);
+		if (i == marks->len)
+			return;
+	} else {
+		i = marks_search(top);
+		if (i == 0)
+			return;
+		i--;
+	}
+	gtk_adjustment_set_value(adj, g_array_index(marks, struct mark, i).prompt);
+}
+
+static void
+prompt_copy_output(VteTerminal *terminal)
+{
+	const struct mark *mark;
+	glong top;
+	glong first;
+	glong last;
+	gchar *text;
+	guint i;
+
+	marks_expire(terminal);
+
+	/* copy the output of the last command started at or above the top */
+	terminal_rows(terminal, NULL, &top, NULL);
+	i = marks_search(top + 1);
+	if (i == 0)
+		return;
+
+	mark = &g_array_index(marks, struct mark, i - 1);
+	first = mark->output >= 0 ? mark->output : mark->prompt + 1;
+	if (i < marks->len) {
+		last = g_array_index(marks, struct mark, i).prompt - 1;
+	} else {
+		glong column;
+
+		vte_terminal_get_cursor_position(terminal, &column, &last);
+	}
+	if (first > last)
+		return;
+
+	text = terminal_text(terminal, first, 0, last);
+	if (text == NULL)
+		return;
+	gtk_clipboard_set_text(gtk_clipboard_get(GDK_SELECTION_CLIPBOARD), text, -1);
+	g_free(text);
+}
+
 static gboolean
 handle_key_press(GtkWidget *widget, GdkEvent *event, gpointer window)
 {
@@ -278,6 +902,25 @@ handle_key_press(GtkWidget *widget, GdkEvent *event, gpointer window)
 		case GDK_KEY_v:
 			vte_terminal_paste_clipboard((VteTerminal *)widget);
 			return TRUE;
+		case GDK_KEY_o:
+			prompt_copy_output((VteTerminal *)widget);
+			return TRUE;
+		case GDK_KEY_Page_Up:
+			prompt_jump((VteTerminal *)widget, FALSE);
+			return TRUE;
+		case GDK_KEY_Page_Down:
+			prompt_jump((VteTerminal *)widget, TRUE);
+			return TRUE;
+		}
+	}
+
+	/* remember where command output starts for prompt marks */
+	if ((event->key.state & modifiers) == 0) {
+		switch (event->key.keyval) {
+		case GDK_KEY_Return:
+		case GDK_KEY_KP_Enter:
+			prompt_command((VteTerminal *)widget, 1);
+			break;
 		}
 	}
 
@@ -294,17 +937,636 @@ handle_selection_changed(VteTerminal *terminal, gpointer data)
 	return TRUE;
 }
 
+/*
+ * Control socket
+ *
+ * Each line received is a command and every command is answered by
+ * exactly one reply starting with either "ok" or "error". Commands are
+ * handled in order and replies are only flushed once all buffered input
+ * is handled, so a client may write a whole batch of commands and read
+ * all the replies in one round-trip. See README.md for the commands.
+ */
+struct control {
+	VteTerminal *terminal;
+	GtkWidget *window;
+	GSocketService *service;
+	gchar *path;
+	dev_t dev;
+	ino_t ino;
+	GList *clients;
+};
+
+struct client {
+	struct control *ctl;
+	GSocketConnection *connection;
+	GDataInputStream *input;
+	GCancellable *cancellable;
+	GString *out;
+	GBytes *pending;
+	gboolean eof;
+	GRegex *wait;
+	gboolean wait_marked;
+	glong wait_row;
+	glong wait_column;
+	guint timeout;
+	GSource *hup;
+};
+
+/* most rows scanned by a wait on every update */
+#define WAIT_ROWS 1000
+
+static void
+client_wait_done(struct client *c)
+{
+	if (c->timeout) {
+		g_source_remove(c->timeout);
+		c->timeout = 0;
+	}
+	if (c->hup) {
+		g_source_destroy(c->hup);
+		g_source_unref(c->hup);
+		c->hup = NULL;
+	}
+	if (c->wait) {
+		g_regex_unref(c->wait);
+		c->wait = NULL;
+	}
+}
+
+static void
+client_free(struct client *c)
+{
+	c->ctl->clients = g_list_remove(c->ctl->clients, c);
+
+	/* pending operations hold their own references and
+	 * will see the cancellation without touching c */
+	g_cancellable_cancel(c->cancellable);
+	g_object_unref(c->cancellable);
+	client_wait_done(c);
+	if (c->pending)
+		g_bytes_unref(c->pending);
+	g_string_free(c->out, TRUE);
+	g_object_unref(c->input);
+	g_object_unref(c->connection);
+	g_free(c);
+}
+
+static void client_flush(struct client *c);
+
+static void
+client_written(GObject *source, GAsyncResult *res, gpointer data)
+{
+	struct client *c = data;
+	GError *error = NULL;
+	gssize ret;
+	gsize size;
+
+	ret = g_output_stream_write_bytes_finish(G_OUTPUT_STREAM(source), res, &error);
+	if (ret < 0) {
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			client_free(c);
+		g_error_free(error);
+		return;
+	}
+
+	size = g_bytes_get_size(c->pending);
+	if ((gsize)ret < size) {
+		GBytes *rest = g_bytes_new_from_bytes(c->pending, ret, size - ret);
+
+		g_bytes_unref(c->pending);
+		c->pending = rest;
+		g_output_stream_write_bytes_async(G_OUTPUT_STREAM(source),
+				c->pending, G_PRIORITY_DEFAULT,
+				c->cancellable, client_written, c);
+		return;
+	}
+
+	g_bytes_unref(c->pending);
+	c->pending = NULL;
+	client_flush(c);
+}
+
+static void
+client_flush(struct client *c)
+{
+	if (c->pending)
+		return;
+
+	if (c->out->len == 0) {
+		if (c->eof)
+			client_free(c);
+		return;
+	}
+
+	c->pending = g_string_free_to_bytes(c->out);
+	c->out = g_string_new(NULL);
+	g_output_stream_write_bytes_async(
+			g_io_stream_get_output_stream(G_IO_STREAM(c->connection)),
+			c->pending, G_PRIORITY_DEFAULT,
+			c->cancellable, client_written, c);
+}
+
+/* remember the cursor position, waits only match text written after it */
+static void
+client_wait_mark(struct client *c)
+{
+	vte_terminal_get_cursor_position(c->ctl->terminal,
+			&c->wait_column, &c->wait_row);
+	c->wait_marked = TRUE;
+}
+
+static gboolean
+client_wait_matches(struct client *c)
+{
+	VteTerminal *terminal = c->ctl->terminal;
+	glong row = c->wait_row;
+	glong column = c->wait_column;
+	glong first;
+	glong bottom;
+	glong screen;
+	gchar *text;
+	gboolean ret;
+
+	terminal_rows(terminal, &first, NULL, &bottom);
+	screen = bottom + 1 - vte_terminal_get_row_count(terminal);
+	first = MAX(first, MIN(screen, bottom + 1 - WAIT_ROWS));
+	if (row < first) {
+		row = first;
+		column = 0;
+	}
+
+	text = terminal_text(terminal, row, column, bottom);
+	ret = text && g_regex_match(c->wait, text, 0, NULL);
+	g_free(text);
+
+	/* only rows still on the screen can change,
+	 * so don't scan the rows above it again */
+	if (!ret && c->wait_row < screen) {
+		c->wait_row = screen;
+		c->wait_column = 0;
+	}
+	return ret;
+}
+
+static void
+client_text(struct client *c, glong first, glong last)
+{
+	gchar *text = terminal_text(c->ctl->terminal, first, 0, last);
+	gsize len;
+
+	if (text == NULL) {
+		g_string_append(c->out, "error no text\n");
+		return;
+	}
+
+	len = strlen(text);
+	g_string_append_printf(c->out, "ok %" G_GSIZE_FORMAT "\n", len);
+	g_string_append_len(c->out, text, len);
+	g_string_append_c(c->out, '\n');
+	g_free(text);
+}
+
+/* newer VTE no longer reports attributes, but can format text as HTML */
+#if !VTE_CHECK_VERSION(0, 72, 0)
+static gboolean
+same_color(const PangoColor *a, const PangoColor *b)
+{
+	return a->red == b->red && a->green == b->green && a->blue == b->blue;
+}
+
+static gboolean
+same_attrs(const VteCharAttributes *a, const VteCharAttributes *b)
+{
+	return a->row == b->row &&
+		same_color(&a->fore, &b->fore) &&
+		same_color(&a->back, &b->back) &&
+		a->underline == b->underline &&
+		a->strikethrough == b->strikethrough;
+}
+
+static void
+client_attrs(struct client *c, glong first, glong last)
+{
+	VteTerminal *terminal = c->ctl->terminal;
+	GArray *attrs = g_array_new(FALSE, FALSE, sizeof(VteCharAttributes));
+	gchar *text = vte_terminal_get_text_range(terminal,
+			first, 0,
+			last, vte_terminal_get_column_count(terminal) - 1,
+			NULL, NULL, attrs);
+	GString *runs;
+	const VteCharAttributes *start = NULL;
+	const VteCharAttributes *end = NULL;
+	guint n = 0;
+	gsize len;
+	gsize i;
+
+	if (text == NULL) {
+		g_string_append(c->out, "error no text\n");
+		g_array_free(attrs, TRUE);
+		return;
+	}
+
+	len = MIN(strlen(text), attrs->len);
+	runs = g_string_new(NULL);
+
+	/* there is an attribute for every byte of text, so
+	 * merge them into runs of equal attributes per row */
+	for (i = 0; i <= len; i++) {
+		const VteCharAttributes *a = NULL;
+
+		if (i < len) {
+			if (text[i] == '\n')
+				continue;
+			a = &g_array_index(attrs, VteCharAttributes, i);
+			if (start && same_attrs(start, a)) {
+				end = a;
+				continue;
+			}
+		}
+		if (start) {
+			g_string_append_printf(runs,
+					"%ld %ld %ld #%04x%04x%04x #%04x%04x%04x %u %u\n",
+					start->row, start->column, end->column + 1,
+					start->fore.red, start->fore.green, start->fore.blue,
+					start->back.red, start->back.green, start->back.blue,
+					start->underline, start->strikethrough);
+			n++;
+		}
+		start = end = a;
+	}
+
+	g_string_append_printf(c->out, "ok %u\n", n);
+	g_string_append_len(c->out, runs->str, runs->len);
+	g_string_free(runs, TRUE);
+	g_free(text);
+	g_array_free(attrs, TRUE);
+}
+#else
+static void
+client_attrs(struct client *c, glong first, glong last)
+{
+	VteTerminal *terminal = c->ctl->terminal;
+	gsize len;
+	gchar *html = vte_terminal_get_text_range_format(terminal, VTE_FORMAT_HTML,
+			first, 0,
+			last, vte_terminal_get_column_count(terminal),
+			&len);
+
+	if (html == NULL) {
+		g_string_append(c->out, "error no text\n");
+		return;
+	}
+
+	g_string_append_printf(c->out, "ok %" G_GSIZE_FORMAT "\n", len);
+	g_string_append_len(c->out, html, len);
+	g_string_append_c(c->out, '\n');
+	g_free(html);
+}
+#endif
+
+static void client_next(struct client *c);
+
+static void
+client_wake(struct client *c, const gchar *reply)
+{
+	client_wait_done(c);
+	g_string_append(c->out, reply);
+	client_next(c);
+}
+
+/* no read is pending during a wait, so watch for the client leaving */
+static gboolean
+client_hup(GSocket *socket, GIOCondition condition, gpointer data)
+{
+	client_free(data);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+client_wait_timeout(gpointer data)
+{
+	struct client *c = data;
+
+	c->timeout = 0;
+	client_wake(c, "error timeout\n");
+	return G_SOURCE_REMOVE;
+}
+
+static void
+client_command(struct client *c, gchar *line)
+{
+	VteTerminal *terminal = c->ctl->terminal;
+	gchar *arg = strchr(line, ' ');
+	glong first;
+	glong last;
+
+	if (arg)
+		*arg++ = '\0';
+	else
+		arg = line + strlen(line);
+
+	if (!strcmp(line, "send")) {
+		gchar *text = g_strcompress(arg);
+
+		/* the lines of a batch are handled in separate main loop
+		 * iterations, so the reply may already be on the screen
+		 * when the following wait is handled */
+		if (!c->wait_marked)
+			client_wait_mark(c);
+		vte_terminal_feed_child(terminal, text, strlen(text));
+		g_free(text);
+		g_string_append(c->out, "ok\n");
+	} else if (!strcmp(line, "text") || !strcmp(line, "attrs")) {
+		if (arg[0] == '\0') {
+			terminal_rows(terminal, NULL, &first, NULL);
+			last = first + vte_terminal_get_row_count(terminal) - 1;
+		} else if (sscanf(arg, "%ld %ld", &first, &last) != 2 || first > last) {
+			g_string_append(c->out, "error invalid rows\n");
+			return;
+		}
+		if (line[0] == 't')
+			client_text(c, first, last);
+		else
+			client_attrs(c, first, last);
+	} else if (!strcmp(line, "wait")) {
+		GError *error = NULL;
+		int timeout;
+		int n = 0;
+
+		if (sscanf(arg, "%d %n", &timeout, &n) != 1 || n == 0 ||
+				timeout < 0 || arg[n] == '\0') {
+			g_string_append(c->out, "error usage: wait TIMEOUT REGEX\n");
+			return;
+		}
+		c->wait = g_regex_new(arg + n, G_REGEX_MULTILINE, 0, &error);
+		if (error) {
+			g_string_append_printf(c->out, "error %s\n", error->message);
+			g_error_free(error);
+			return;
+		}
+		/* match against everything written since the first send
+		 * after the last wait, or since now if there was none */
+		if (!c->wait_marked)
+			client_wait_mark(c);
+		c->wait_marked = FALSE;
+		if (client_wait_matches(c)) {
+			client_wait_done(c);
+			g_string_append(c->out, "ok\n");
+			return;
+		}
+		if (timeout)
+			c->timeout = g_timeout_add(timeout, client_wait_timeout, c);
+		c->hup = g_socket_create_source(
+				g_socket_connection_get_socket(c->connection),
+				G_IO_HUP | G_IO_ERR, NULL);
+		g_source_set_callback(c->hup, G_SOURCE_FUNC(client_hup), c, NULL);
+		g_source_attach(c->hup, NULL);
+	} else if (!strcmp(line, "resize")) {
+		glong columns;
+		glong rows;
+
+		if (sscanf(arg, "%ld %ld", &columns, &rows) != 2 || columns < 1 || rows < 1) {
+			g_string_append(c->out, "error usage: resize COLUMNS ROWS\n");
+			return;
+		}
+		resize_window(GTK_WIDGET(terminal),
+				columns * vte_terminal_get_char_width(terminal),
+				rows * vte_terminal_get_char_height(terminal),
+				c->ctl->window);
+		vte_terminal_set_size(terminal, columns, rows);
+		g_string_append(c->out, "ok\n");
+	} else if (!strcmp(line, "cursor")) {
+		glong column;
+		glong row;
+
+		vte_terminal_get_cursor_position(terminal, &column, &row);
+		g_string_append_printf(c->out, "ok %ld %ld\n", row, column);
+	} else if (!strcmp(line, "size")) {
+		glong top;
+
+		terminal_rows(terminal, &first, &top, NULL);
+		g_string_append_printf(c->out, "ok %ld %ld %ld %ld\n",
+				vte_terminal_get_column_count(terminal),
+				vte_terminal_get_row_count(terminal),
+				first, top);
+	} else {
+		g_string_append_printf(c->out, "error unknown command '%s'\n", line);
+	}
+}
+
+static void
+client_read_line(GObject *source, GAsyncResult *res, gpointer data)
+{
+	struct client *c = data;
+	GError *error = NULL;
+	gchar *line;
+
+	line = g_data_input_stream_read_line_finish(G_DATA_INPUT_STREAM(source),
+			res, NULL, &error);
+	if (error) {
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			client_free(c);
+		g_error_free(error);
+		return;
+	}
+
+	if (line == NULL) {
+		/* send any remaining replies before closing */
+		c->eof = TRUE;
+		client_flush(c);
+		return;
+	}
+
+	client_command(c, line);
+	g_free(line);
+
+	if (c->wait == NULL)
+		client_next(c);
+	else
+		client_flush(c);
+}
+
+static void
+client_next(struct client *c)
+{
+	/* only flush replies once a whole batch of commands is handled */
+	if (g_buffered_input_stream_get_available(G_BUFFERED_INPUT_STREAM(c->input)) == 0)
+		client_flush(c);
+
+	g_data_input_stream_read_line_async(c->input,
+			G_PRIORITY_DEFAULT, c->cancellable,
+			client_read_line, c);
+}
+
+static gboolean
+control_incoming(GSocketService *service, GSocketConnection *connection,
+		GObject *source, gpointer data)
+{
+	struct control *ctl = data;
+	struct client *c = g_new0(struct client, 1);
+
+	c->ctl = ctl;
+	c->connection = g_object_ref(connection);
+	c->input = g_data_input_stream_new(
+			g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+	g_data_input_stream_set_newline_type(c->input,
+			G_DATA_STREAM_NEWLINE_TYPE_LF);
+	c->cancellable = g_cancellable_new();
+	c->out = g_string_new(NULL);
+	ctl->clients = g_list_prepend(ctl->clients, c);
+
+	client_next(c);
+	return TRUE;
+}
+
+static void
+control_contents_changed(VteTerminal *terminal, gpointer data)
+{
+	struct control *ctl = data;
+	GList *l = ctl->clients;
+
+	while (l) {
+		struct client *c = l->data;
+
+		/* waking c may free it */
+		l = l->next;
+		if (c->wait && client_wait_matches(c))
+			client_wake(c, "ok\n");
+	}
+}
+
+static gboolean
+control_owns_path(struct control *ctl)
+{
+	struct stat st;
+
+	return g_lstat(ctl->path, &st) == 0 &&
+		st.st_dev == ctl->dev && st.st_ino == ctl->ino;
+}
+
+static gboolean
+control_in_use(const gchar *path)
+{
+	GSocket *socket;
+	GSocketAddress *address;
+	gboolean ret;
+
+	socket = g_socket_new(G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+			G_SOCKET_PROTOCOL_DEFAULT, NULL);
+	if (socket == NULL)
+		return FALSE;
+
+	address = g_unix_socket_address_new(path);
+	ret = g_socket_connect(socket, address, NULL, NULL);
+	g_object_unref(address);
+	g_object_unref(socket);
+	return ret;
+}
+
+static void
+control_destroy(GtkWidget *window, gpointer data)
+{
+	struct control *ctl = data;
+
+	g_signal_handlers_disconnect_by_data(ctl->terminal, ctl);
+	g_socket_service_stop(ctl->service);
+	g_socket_listener_close(G_SOCKET_LISTENER(ctl->service));
+	g_object_unref(ctl->service);
+	while (ctl->clients)
+		client_free(ctl->clients->data);
+	if (control_owns_path(ctl))
+		g_unlink(ctl->path);
+	g_free(ctl->path);
+	g_free(ctl);
+}
+
+static void
+control_setup(const gchar *option, VteTerminal *terminal, GtkWidget *window)
+{
+	struct control *ctl;
+	GSocketAddress *address;
+	GError *error = NULL;
+	struct stat st;
+	gchar **parts;
+	gchar *path;
+	gchar pid[16];
+	mode_t mask;
+
+	/* %p is replaced by our pid so every window gets its own socket */
+	g_snprintf(pid, sizeof(pid), "%d", (int)getpid());
+	parts = g_strsplit(option, "%p", -1);
+	path = g_strjoinv(pid, parts);
+	g_strfreev(parts);
+
+	if (g_lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			g_printerr("Error creating control socket '%s': "
+					"file exists\n", path);
+			g_free(path);
+			return;
+		}
+		if (control_in_use(path)) {
+			g_printerr("Error creating control socket '%s': "
+					"in use by another window\n", path);
+			g_free(path);
+			return;
+		}
+		/* stale socket from an earlier run */
+		g_unlink(path);
+	}
+
+	ctl = g_new0(struct control, 1);
+	ctl->terminal = terminal;
+	ctl->window = window;
+	ctl->path = path;
+	ctl->service = g_socket_service_new();
+
+	address = g_unix_socket_address_new(path);
+	mask = umask(0077);
+	g_socket_listener_add_address(G_SOCKET_LISTENER(ctl->service),
+			address, G_SOCKET_TYPE_STREAM,
+			G_SOCKET_PROTOCOL_DEFAULT,
+			NULL, NULL, &error);
+	umask(mask);
+	g_object_unref(address);
+	if (error) {
+		g_printerr("Error creating control socket '%s': %s\n",
+				path, error->message);
+		g_error_free(error);
+		g_object_unref(ctl->service);
+		g_free(ctl->path);
+		g_free(ctl);
+		return;
+	}
+	if (g_lstat(path, &st) == 0) {
+		ctl->dev = st.st_dev;
+		ctl->ino = st.st_ino;
+	}
+
+	g_signal_connect(ctl->service, "incoming",
+			G_CALLBACK(control_incoming), ctl);
+	g_signal_connect(terminal, "contents-changed",
+			G_CALLBACK(control_contents_changed), ctl);
+	g_signal_connect(window, "destroy",
+			G_CALLBACK(control_destroy), ctl);
+	g_socket_service_start(ctl->service);
+}
+
 struct config {
 	gchar *config_file;
 	gchar *font;
 	gint lines;
 	gchar *role;
+	gchar *control_socket;
 	gboolean nodecorations;
 	gboolean scroll_on_output;
 	gboolean scroll_on_keystroke;
 	gboolean mouse_autohide;
 	gboolean sync_clipboard;
 	gboolean urgent_on_bell;
+	gboolean sixel;
+	gboolean auto_opaque;
+	gint opaque_rate;
 	gchar **command_argv;
 #ifdef VTE_TYPE_REGEX
 	VteRegex *regex;
@@ -560,6 +1822,13 @@ setup(int argc, char *argv[])
 			.description = "Set window role",
 			.arg_description = "ROLE",
 		},
+		{
+			.long_name = "control-socket",
+			.arg = G_OPTION_ARG_STRING,
+			.arg_data = &conf.control_socket,
+			.description = "Listen for commands on a unix socket, %p is replaced by the pid",
+			.arg_description = "PATH",
+		},
 		{
 			.long_name = "no-decorations",
 			.arg = G_OPTION_ARG_NONE,
@@ -596,6 +1865,25 @@ setup(int argc, char *argv[])
 			.arg_data = &conf.urgent_on_bell,
 			.description = "Set window urgency hint on bell",
 		},
+		{
+			.long_name = "sixel",
+			.arg = G_OPTION_ARG_NONE,
+			.arg_data = &conf.sixel,
+			.description = "Toggle sixel image support",
+		},
+		{
+			.long_name = "auto-opaque",
+			.arg = G_OPTION_ARG_NONE,
+			.arg_data = &conf.auto_opaque,
+			.description = "Toggle opaque background when maximized or busy",
+		},
+		{
+			.long_name = "opaque-rate",
+			.arg = G_OPTION_ARG_INT,
+			.arg_data = &conf.opaque_rate,
+			.description = "Updates per second making the background opaque, 0 disables",
+			.arg_description = "RATE",
+		},
 		{
 			.long_name = G_OPTION_REMAINING,
 			.arg = G_OPTION_ARG_STRING_ARRAY,
@@ -680,6 +1968,18 @@ setup(int argc, char *argv[])
 	g_signal_connect(widget, "key-press-event",
 			G_CALLBACK(handle_key_press), window);
 
+	/* Remember prompts reported by the shell */
+	marks = g_array_new(FALSE, FALSE, sizeof(struct mark));
+#if VTE_CHECK_VERSION(0, 78, 0)
+	g_signal_connect(widget, "termprop-changed::" VTE_TERMPROP_SHELL_PRECMD,
+			G_CALLBACK(prompt_termprop), NULL);
+	g_signal_connect(widget, "termprop-changed::" VTE_TERMPROP_SHELL_PREEXEC,
+			G_CALLBACK(prompt_termprop), NULL);
+#else
+	g_signal_connect(widget, "current-directory-uri-changed",
+			G_CALLBACK(prompt_directory_changed), NULL);
+#endif
+
 	/* Connect to bell signal */
 	if (conf.urgent_on_bell) {
 		g_signal_connect(widget, "bell",
@@ -699,6 +1999,19 @@ setup(int argc, char *argv[])
 	vte_terminal_set_mouse_autohide(terminal, conf.mouse_autohide);
 	vte_terminal_set_cursor_blink_mode(terminal, VTE_CURSOR_BLINK_OFF);
 	vte_terminal_set_cursor_shape(terminal, VTE_CURSOR_SHAPE_BLOCK);
+#if VTE_CHECK_VERSION(0, 62, 0)
+	/* VTE keeps decoded images with their rows in the scrollback
+	 * and frees them along with the rows. */
+	if (conf.sixel) {
+		if (vte_get_feature_flags() & VTE_FEATURE_FLAG_SIXEL)
+			vte_terminal_set_enable_sixel(terminal, TRUE);
+		else
+			g_printerr("Sixel images are not supported by this VTE build\n");
+	}
+#else
+	if (conf.sixel)
+		g_printerr("Sixel images need VTE 0.62 or newer\n");
+#endif
 	if (conf.lines)
 		vte_terminal_set_scrollback_lines(terminal, conf.lines);
 	if (conf.palette_size) {
@@ -708,6 +2021,14 @@ setup(int argc, char *argv[])
 				conf.palette,
 				conf.palette_size - 2);
 	}
+	if (conf.auto_opaque && conf.palette_size && conf.background.alpha < 1.)
+		opacity_setup(window, terminal, &conf.background, conf.opaque_rate);
+	if (g_getenv("ST_FRAME_STATS")) {
+		g_signal_connect(window, "realize",
+				G_CALLBACK(frame_stats_realize), NULL);
+		g_signal_connect(window, "destroy",
+				G_CALLBACK(frame_stats_print), NULL);
+	}
 	if (conf.highlight.alpha)
 		vte_terminal_set_color_highlight(terminal, &conf.highlight);
 	if (conf.highlight_fg.alpha)
@@ -729,6 +2050,10 @@ setup(int argc, char *argv[])
 #endif
 		vte_terminal_match_set_cursor_name(terminal, id, "pointer");
 	}
+	if (conf.control_socket) {
+		control_setup(conf.control_socket, terminal, window);
+		g_free(conf.control_socket);
+	}
 
 	if (conf.command_argv == NULL || conf.command_argv[0] == NULL) {
 		g_strfreev(conf.command_argv);
@@ -769,6 +2094,9 @@ setup(int argc, char *argv[])
 int
 main(int argc, char *argv[])
 {
+	if (argc > 0 && !strcmp(argv[0], LAUNCHER_NAME))
+		return launcher_main(argc, argv);
+
 	if (setup(argc, argv))
 		gtk_main();
 